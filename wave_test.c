@@ -1,9 +1,10 @@
 /******************************************************************************
 
-wave_test.c -  Test and demo driver for wavread and wavwrite functions
+wave_test.c -  Test and demo driver for wavread, wavwrite and wavtranscode functions
 
     wavread            Read .wav file
     wavwrite           Write .wav file
+    wavtranscode       Convert .wav bit depth / channels (PCM to PCM)
 
 ******************************************************************************/
 /*-----------------------------------------------------------------------------
@@ -45,6 +46,58 @@ int wavematch(float *wdataL, float *rdataL, float *wdataR, float *rdataR, int si
     return res;
 }
 //*****************************************************************************
+// Write a 16 bit mono PCM file with an extended fmt chunk (18 bytes, or 40
+// bytes WAVE_FORMAT_EXTENSIBLE) and an odd sized LIST chunk ahead of the data
+static void putLE(FILE *file, unsigned int value, int bytes) {
+
+    int k;
+    for (k = 0; k < bytes; k++){
+        fputc((value >> (8*k)) & 0xFF, file);
+    }
+}
+int writeNonCanonicalWave(char *filename, const short *samples, int size, int extensible) {
+
+    // KSDATAFORMAT_SUBTYPE_PCM
+    const unsigned char pcmGuid[16] = {0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00,
+                                       0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71};
+    const int fmtSize = extensible ? 40 : 18;
+    FILE *file = fopen(filename, "wb");
+    int k;
+
+    if (file == NULL) {
+        return 1;
+    }
+    fwrite("RIFF", 1, 4, file);
+    putLE(file, 4 + (8+fmtSize) + (8+5+1) + (8+2*size), 4);
+    fwrite("WAVE", 1, 4, file);
+    fwrite("fmt ", 1, 4, file);
+    putLE(file, fmtSize, 4);
+    putLE(file, extensible ? 0xFFFE : 1, 2);
+    putLE(file, 1, 2);          // mono
+    putLE(file, 44100, 4);
+    putLE(file, 44100*2, 4);
+    putLE(file, 2, 2);
+    putLE(file, 16, 2);
+    if (extensible) {
+        putLE(file, 22, 2);     // cbSize
+        putLE(file, 16, 2);     // valid bits per sample
+        putLE(file, 0x4, 4);    // channel mask: front center
+        fwrite(pcmGuid, 1, sizeof(pcmGuid), file);
+    } else {
+        putLE(file, 0, 2);      // cbSize
+    }
+    fwrite("LIST", 1, 4, file);
+    putLE(file, 5, 4);
+    fwrite("INFO\0\0", 1, 6, file);
+    fwrite("data", 1, 4, file);
+    putLE(file, 2*size, 4);
+    for (k = 0; k < size; k++){
+        putLE(file, (unsigned short) samples[k], 2);
+    }
+    fclose(file);
+    return 0;
+}
+//*****************************************************************************
 // Test driver
 int main(){
 
@@ -84,6 +137,69 @@ int main(){
         printf("\nVerification: FAILED\n");
     }
 
+    // Transcode checks, PCM to PCM with no float round trip
+    int k;
+    int res = 1;
+    float *mix = (float*) malloc(size*sizeof(float));
+    for (k = 0; k < size; k++){
+        mix[k] = (wdataL[k] + wdataR[k]) / 2;
+    }
+
+    // 32 bit stereo -> 24 bit stereo -> 32 bit stereo
+    res &= wavtranscode("mytest.wav", "mytest24.wav", 2, 24) == 0;
+    res &= wavtranscode("mytest24.wav", "mytest24s.wav", 2, 32) == 0;
+    res &= wavread("mytest24s.wav", &rdataL, &rdataR, size, sampleRate, 2, 32) == 0;
+    res &= wavematch(wdataL, rdataL, wdataR, rdataR, size, 24);
+    res &= wavematch(wdataR, rdataR, wdataL, rdataL, size, 24);
+
+    // 32 bit stereo -> 16 bit mono (downmix) -> 32 bit mono
+    res &= wavtranscode("mytest.wav", "mytest16.wav", 1, 16) == 0;
+    res &= wavtranscode("mytest16.wav", "mytest16m.wav", 1, 32) == 0;
+    res &= wavread("mytest16m.wav", &rdataL, &rdataR, size, sampleRate, 1, 32) == 0;
+    res &= wavematch(mix, rdataL, mix, rdataL, size, 16);
+
+    // 32 bit stereo -> 8 bit mono (unsigned, offset 128) -> 32 bit stereo (duplicate)
+    res &= wavtranscode("mytest.wav", "mytest8.wav", 1, 8) == 0;
+    res &= wavtranscode("mytest8.wav", "mytest8s.wav", 2, 32) == 0;
+    res &= wavread("mytest8s.wav", &rdataL, &rdataR, size, sampleRate, 2, 32) == 0;
+    res &= wavematch(mix, rdataL, mix, rdataL, size, 8);
+    res &= wavematch(mix, rdataR, mix, rdataR, size, 8);
+
+    // Non-canonical headers: 18 byte fmt chunk, WAVE_FORMAT_EXTENSIBLE,
+    // both with a LIST chunk before data
+    short samples[4] = {0, 16384, -16384, -32768};
+    float expected[4];
+    for (k = 0; k < 4; k++){
+        expected[k] = (float) samples[k] / 32768;
+    }
+    res &= writeNonCanonicalWave("mytestnc.wav", samples, 4, 0) == 0;
+    res &= wavtranscode("mytestnc.wav", "mytestnc32.wav", 1, 32) == 0;
+    res &= wavread("mytestnc32.wav", &rdataL, &rdataR, 4, sampleRate, 1, 32) == 0;
+    res &= wavematch(expected, rdataL, expected, rdataL, 4, 16);
+
+    res &= writeNonCanonicalWave("mytestex.wav", samples, 4, 1) == 0;
+    res &= wavtranscode("mytestex.wav", "mytestex32.wav", 1, 32) == 0;
+    res &= wavread("mytestex32.wav", &rdataL, &rdataR, 4, sampleRate, 1, 32) == 0;
+    res &= wavematch(expected, rdataL, expected, rdataL, 4, 16);
+
+    // Rejected: not a wave file, in-place conversion
+    res &= wavtranscode("wave_test.c", "mytestbad.wav", 1, 16) != 0;
+    res &= wavtranscode("mytest.wav", "mytest.wav", 1, 16) != 0;
+
+    // Write failure (disk full) must be reported
+    FILE *full = fopen("/dev/full", "wb");
+    if (full != NULL) {
+        fclose(full);
+        res &= wavtranscode("mytest.wav", "/dev/full", 1, 16) != 0;
+    }
+
+    if (res) {
+        printf("\nTranscode verification: SUCCESFUL\n");
+    } else {
+        printf("\nTranscode verification: FAILED\n");
+    }
+
+    free(mix);
     return 0;
 }
 
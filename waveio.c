@@ -4,6 +4,7 @@ waveio.c - Wave file .wav read/write functions
 
     wavread            Read .wav file
     wavwrite           Write .wav file
+    wavtranscode       Convert .wav bit depth / channels (PCM to PCM)
     sec2time           Convert seconds to HH:MM:SS.mmm
 
     plus other helper functions
@@ -17,10 +18,13 @@ waveio.c - Wave file .wav read/write functions
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
+#include <sys/stat.h>
 #include "waveio.h"
 #include "utils.h"
 #define TRUE 1
 #define FALSE 0
+#define TRANSCODE_BLOCK_FRAMES 4096
+#define WAVE_MAX_DATA_SIZE (0xFFFFFFFFULL - (4+8+16+8))
 
 //*****************************************************************************
 // Covert seconds to HH:MM:SS.mmm
@@ -115,6 +119,93 @@ void displayHeader(struct HEADER *header)
 
 }
 //*****************************************************************************
+// Read .wav file header: check RIFF/WAVE markers, parse the "fmt " chunk and
+// skip any other chunks (LIST, fact, ...) up to "data". On success the file
+// is positioned at the first sample of the data chunk.
+static int readWaveHeader(FILE *ptr, struct HEADER *header)
+{
+    unsigned char buffer4[4];
+    unsigned char buffer2[2];
+    unsigned char chunk_id[4];
+    unsigned int chunk_size;
+    int read = 1;
+    int has_fmt = FALSE;
+
+    read &= fread(header->riff, sizeof(header->riff), 1, ptr);
+    read &= fread(buffer4, sizeof(buffer4), 1, ptr);
+    header->overall_size = buffer4ToInt(buffer4);
+    read &= fread(header->wave, sizeof(header->wave), 1, ptr);
+    if (read != 1 || memcmp(header->riff, "RIFF", 4) != 0 || memcmp(header->wave, "WAVE", 4) != 0) {
+        printf("Error: not a RIFF/WAVE file.\n");
+        return 1;
+    }
+
+    // Walk the chunk list until the data chunk
+    while (1) {
+        read &= fread(chunk_id, sizeof(chunk_id), 1, ptr);
+        read &= fread(buffer4, sizeof(buffer4), 1, ptr);
+        chunk_size = (unsigned int) buffer4ToInt(buffer4);
+        if (read != 1) {
+            printf("Error reading wave file header: no data chunk.\n");
+            return 1;
+        }
+
+        if (memcmp(chunk_id, "fmt ", 4) == 0) {
+            if (chunk_size < 16) {
+                printf("Error: fmt chunk too short (%u bytes).\n", chunk_size);
+                return 1;
+            }
+            memcpy(header->fmt_chunk_marker, chunk_id, 4);
+            header->fmt_chunk_marker[3] = '\0';
+            header->length_of_fmt = chunk_size;
+            read &= fread(buffer2, sizeof(buffer2), 1, ptr);
+            header->audioFormat = buffer2ToInt(buffer2);
+            read &= fread(buffer2, sizeof(buffer2), 1, ptr);
+            header->numChannels = buffer2ToInt(buffer2);
+            read &= fread(buffer4, sizeof(buffer4), 1, ptr);
+            header->sampleRate = buffer4ToInt(buffer4);
+            read &= fread(buffer4, sizeof(buffer4), 1, ptr);
+            header->byteRate  = buffer4ToInt(buffer4);
+            read &= fread(buffer2, sizeof(buffer2), 1, ptr);
+            header->blockAlign = buffer2ToInt(buffer2);
+            read &= fread(buffer2, sizeof(buffer2), 1, ptr);
+            header->bitsPerSample = buffer2ToInt(buffer2);
+            chunk_size -= 16;
+            // WAVE_FORMAT_EXTENSIBLE: cbSize, valid bits, channel mask, then
+            // the SubFormat GUID whose first two bytes are the format code
+            if (header->audioFormat == (short)0xFFFE && chunk_size >= 24) {
+                read &= fread(buffer4, sizeof(buffer4), 1, ptr);
+                read &= fread(buffer4, sizeof(buffer4), 1, ptr);
+                read &= fread(buffer2, sizeof(buffer2), 1, ptr);
+                header->audioFormat = buffer2ToInt(buffer2);
+                chunk_size -= 10;
+            }
+            // Skip remaining extension bytes past the format
+            has_fmt = TRUE;
+        } else if (memcmp(chunk_id, "data", 4) == 0) {
+            if (!has_fmt) {
+                printf("Error: data chunk before fmt chunk.\n");
+                return 1;
+            }
+            memcpy(header->data_chunk_header, chunk_id, 4);
+            header->data_size = chunk_size;
+            break;
+        }
+
+        // Chunks are padded to an even number of bytes
+        if (read != 1 || fseek(ptr, (long) chunk_size + (chunk_size & 1), SEEK_CUR) != 0) {
+            printf("Error reading wave file header.\n");
+            return 1;
+        }
+    }
+
+    if (header->numChannels <= 0 || header->bitsPerSample <= 0) {
+        printf("Error reading wave file header.\n");
+        return 1;
+    }
+    return 0;
+}
+//*****************************************************************************
 // Read data from .wav file
 int wavread(char* filename,
             float **dataL, float **dataR,
@@ -126,8 +217,6 @@ int wavread(char* filename,
 {
     // Local variables
     struct HEADER header;
-    unsigned char buffer4[4];
-    unsigned char buffer2[2];
     char* seconds_to_time(float seconds);
     FILE *ptr;
     int read = 0;
@@ -147,30 +236,10 @@ int wavread(char* filename,
      }
 
     // Read wave file header
-    read = fread(header.riff, sizeof(header.riff), 1, ptr);
-    header.riff[4] = '\0';
-    read = fread(buffer4, sizeof(buffer4), 1, ptr);
-    header.overall_size = buffer4ToInt(buffer4);
-    read = fread(header.wave, sizeof(header.wave), 1, ptr);
-    read = fread(header.fmt_chunk_marker, sizeof(header.fmt_chunk_marker), 1, ptr);
-    header.fmt_chunk_marker[3] = '\0';
-    read = fread(buffer4, sizeof(buffer4), 1, ptr);
-    header.length_of_fmt = buffer4ToInt(buffer4);
-    read = fread(buffer2, sizeof(buffer2), 1, ptr);
-    header.audioFormat = buffer2ToInt(buffer2);
-    read = fread(buffer2, sizeof(buffer2), 1, ptr);
-    header.numChannels = buffer2ToInt(buffer2);
-    read = fread(buffer4, sizeof(buffer4), 1, ptr);
-    header.sampleRate = buffer4ToInt(buffer4);
-    read = fread(buffer4, sizeof(buffer4), 1, ptr);
-    header.byteRate  = buffer4ToInt(buffer4);
-    read = fread(buffer2, sizeof(buffer2), 1, ptr);
-    header.blockAlign = buffer2ToInt(buffer2);
-    read = fread(buffer2, sizeof(buffer2), 1, ptr);
-    header.bitsPerSample = buffer2ToInt(buffer2);
-    read = fread(header.data_chunk_header, sizeof(header.data_chunk_header), 1, ptr);
-    read = fread(buffer4, sizeof(buffer4), 1, ptr);
-    header.data_size = buffer4ToInt(buffer4);
+    if (readWaveHeader(ptr, &header) != 0) {
+        fclose(ptr);
+        return 1;
+    }
 
     // Calculate no.of samples
     long num_samples = (8 * header.data_size) / (header.numChannels * header.bitsPerSample);
@@ -268,7 +337,6 @@ int wavread(char* filename,
 
     // Memory  cleanup
     fclose(ptr);
-    free(filename);
 
     // Debug
     //displayHeader(&header);
@@ -383,37 +451,46 @@ void waveAddSample( Wave* wave, const float* samples ){
     }
 }
 //*****************************************************************************
+// Write wave header to an open .wav file
+static int waveHeaderToFile( WaveHeader* header, FILE* file ){
+    size_t written;
+
+    // Before you write it, make sure all numbers are little endian
+    toLittleEndian(sizeof(int), (void*)&(header->overall_size));
+    toLittleEndian(sizeof(int), (void*)&(header->length_of_fmt));
+    toLittleEndian(sizeof(short int), (void*)&(header->audioFormat));
+    toLittleEndian(sizeof(short int), (void*)&(header->numChannels));
+    toLittleEndian(sizeof(int), (void*)&(header->sampleRate));
+    toLittleEndian(sizeof(int), (void*)&(header->byteRate));
+    toLittleEndian(sizeof(short int), (void*)&(header->blockAlign));
+    toLittleEndian(sizeof(short int), (void*)&(header->bitsPerSample));
+    toLittleEndian(sizeof(int), (void*)&(header->data_size));
+
+    written = fwrite( header, sizeof(WaveHeader), 1, file );
+
+    // Convert back to system endian-ness
+    toLittleEndian(sizeof(int), (void*)&(header->overall_size));
+    toLittleEndian(sizeof(int), (void*)&(header->length_of_fmt));
+    toLittleEndian(sizeof(short int), (void*)&(header->audioFormat));
+    toLittleEndian(sizeof(short int), (void*)&(header->numChannels));
+    toLittleEndian(sizeof(int), (void*)&(header->sampleRate));
+    toLittleEndian(sizeof(int), (void*)&(header->byteRate));
+    toLittleEndian(sizeof(short int), (void*)&(header->blockAlign));
+    toLittleEndian(sizeof(short int), (void*)&(header->bitsPerSample));
+    toLittleEndian(sizeof(int), (void*)&(header->data_size));
+
+    return (written == 1) ? 0 : 1;
+}
+//*****************************************************************************
 // Write wave to .wav file
 void waveToFile( Wave* wave, const char* filename ){
 
-    // Before you read it, make sure all numbers are little endian
-    toLittleEndian(sizeof(int), (void*)&(wave->header.overall_size));
-    toLittleEndian(sizeof(int), (void*)&(wave->header.length_of_fmt));
-    toLittleEndian(sizeof(short int), (void*)&(wave->header.audioFormat));
-    toLittleEndian(sizeof(short int), (void*)&(wave->header.numChannels));
-    toLittleEndian(sizeof(int), (void*)&(wave->header.sampleRate));
-    toLittleEndian(sizeof(int), (void*)&(wave->header.byteRate));
-    toLittleEndian(sizeof(short int), (void*)&(wave->header.blockAlign));
-    toLittleEndian(sizeof(short int), (void*)&(wave->header.bitsPerSample));
-    toLittleEndian(sizeof(int), (void*)&(wave->header.data_size));
-
     // Open the wave file, write header, then write data
     FILE *file;
     file = fopen(filename, "wb");
-    fwrite( &(wave->header), sizeof(WaveHeader), 1, file );
+    waveHeaderToFile( &(wave->header), file );
     fwrite( (void*)(wave->data), sizeof(char), wave->size, file );
     fclose( file );
-
-    // Convert back to system endian-ness
-    toLittleEndian(sizeof(int), (void*)&(wave->header.overall_size));
-    toLittleEndian(sizeof(int), (void*)&(wave->header.length_of_fmt));
-    toLittleEndian(sizeof(short int), (void*)&(wave->header.audioFormat));
-    toLittleEndian(sizeof(short int), (void*)&(wave->header.numChannels));
-    toLittleEndian(sizeof(int), (void*)&(wave->header.sampleRate));
-    toLittleEndian(sizeof(int), (void*)&(wave->header.byteRate));
-    toLittleEndian(sizeof(short int), (void*)&(wave->header.blockAlign));
-    toLittleEndian(sizeof(short int), (void*)&(wave->header.bitsPerSample));
-    toLittleEndian(sizeof(int), (void*)&(wave->header.data_size));
 }
 //*****************************************************************************
 // [-1, ]] saturation
@@ -458,6 +535,246 @@ int wavwrite(char* filename, float *dataR, float *dataL,
 
     return 0;
 
+}
+//*****************************************************************************
+// Load one little endian PCM sample, MSB aligned to 32 bits
+// (8 bit PCM is unsigned with a 128 offset, wider formats are signed)
+static inline int pcmLoad(const unsigned char* p, const int bits){
+    switch (bits) {
+        case 8:
+            return (int)((unsigned int)(p[0] ^ 0x80) << 24);
+        case 16:
+            return (int)(((unsigned int)p[0] << 16) | ((unsigned int)p[1] << 24));
+        case 24:
+            return (int)(((unsigned int)p[0] << 8) | ((unsigned int)p[1] << 16) |
+                         ((unsigned int)p[2] << 24));
+        default:
+            return (int)((unsigned int)p[0] | ((unsigned int)p[1] << 8) |
+                         ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24));
+    }
+}
+//*****************************************************************************
+// Shift down with round-half-up, saturate and store one little endian PCM sample
+static inline void pcmStore(unsigned char* p, long long acc, const int bits, const int shift){
+    const long long high_limit = (1LL << (bits - 1)) - 1;
+    const long long low_limit = -high_limit - 1;
+
+    if (shift > 0)
+        acc = (acc + (1LL << (shift - 1))) >> shift;
+    acc = (acc > high_limit) ? high_limit : (acc < low_limit) ? low_limit : acc;
+
+    switch (bits) {
+        case 8:
+            p[0] = (unsigned char)(acc + 128);
+            break;
+        case 16:
+            p[0] = (unsigned char)acc;
+            p[1] = (unsigned char)(acc >> 8);
+            break;
+        case 24:
+            p[0] = (unsigned char)acc;
+            p[1] = (unsigned char)(acc >> 8);
+            p[2] = (unsigned char)(acc >> 16);
+            break;
+        default:
+            p[0] = (unsigned char)acc;
+            p[1] = (unsigned char)(acc >> 8);
+            p[2] = (unsigned char)(acc >> 16);
+            p[3] = (unsigned char)(acc >> 24);
+            break;
+    }
+}
+//*****************************************************************************
+// PCM to PCM block kernels, one per (source bits, destination bits) pair so the
+// compiler can fold the load/store switches and shifts into the inner loop.
+// Channel layout: 1->1 / 2->2 copy, 2->1 downmix (L+R)/2, 1->2 duplicate.
+#define PCM_KERNEL(SRC, DST)                                                    \
+static void pcmKernel_##SRC##_##DST(unsigned char* dst, const unsigned char* src, \
+                                    const long long nFrames,                    \
+                                    const int srcChannels, const int dstChannels) \
+{                                                                               \
+    long long i;                                                                \
+    if (srcChannels == dstChannels) {                                           \
+        const long long n = nFrames * srcChannels;                              \
+        for (i = 0; i < n; i++)                                                 \
+            pcmStore(dst + i*(DST/8), pcmLoad(src + i*(SRC/8), SRC),            \
+                     DST, 32 - DST);                                            \
+    } else if (srcChannels == 2) {                                              \
+        for (i = 0; i < nFrames; i++)                                           \
+            pcmStore(dst + i*(DST/8),                                           \
+                     (long long)pcmLoad(src + (2*i+0)*(SRC/8), SRC) +           \
+                     (long long)pcmLoad(src + (2*i+1)*(SRC/8), SRC),            \
+                     DST, 33 - DST);                                            \
+    } else {                                                                    \
+        for (i = 0; i < nFrames; i++) {                                         \
+            pcmStore(dst + (2*i+0)*(DST/8), pcmLoad(src + i*(SRC/8), SRC),      \
+                     DST, 32 - DST);                                            \
+            memcpy(dst + (2*i+1)*(DST/8), dst + (2*i+0)*(DST/8), DST/8);        \
+        }                                                                       \
+    }                                                                           \
+}
+
+PCM_KERNEL(8, 8)  PCM_KERNEL(8, 16)  PCM_KERNEL(8, 24)  PCM_KERNEL(8, 32)
+PCM_KERNEL(16, 8) PCM_KERNEL(16, 16) PCM_KERNEL(16, 24) PCM_KERNEL(16, 32)
+PCM_KERNEL(24, 8) PCM_KERNEL(24, 16) PCM_KERNEL(24, 24) PCM_KERNEL(24, 32)
+PCM_KERNEL(32, 8) PCM_KERNEL(32, 16) PCM_KERNEL(32, 24) PCM_KERNEL(32, 32)
+
+typedef void (*PcmKernel)(unsigned char*, const unsigned char*, const long long, const int, const int);
+
+// Indexed by [srcBits/8 - 1][dstBits/8 - 1]
+static const PcmKernel pcmKernels[4][4] = {
+    { pcmKernel_8_8,  pcmKernel_8_16,  pcmKernel_8_24,  pcmKernel_8_32  },
+    { pcmKernel_16_8, pcmKernel_16_16, pcmKernel_16_24, pcmKernel_16_32 },
+    { pcmKernel_24_8, pcmKernel_24_16, pcmKernel_24_24, pcmKernel_24_32 },
+    { pcmKernel_32_8, pcmKernel_32_16, pcmKernel_32_24, pcmKernel_32_32 }
+};
+//*****************************************************************************
+// Supported PCM word sizes for transcoding
+static inline int pcmBitsSupported(int bits){
+    return bits == 8 || bits == 16 || bits == 24 || bits == 32;
+}
+//*****************************************************************************
+// Convert .wav file bit depth and/or channel layout (PCM to PCM, one pass,
+// no float round trip). Sample rate is kept from the source file.
+// Source and destination must be different files (no in-place conversion).
+int wavtranscode(char* srcFilename, char* dstFilename,
+                 int numChannels,
+                 int bitsPerSample
+                 )
+{
+    struct HEADER srcHeader;
+    WaveHeader dstHeader;
+    struct stat srcStat, dstStat;
+    FILE *src, *dst;
+    unsigned char *srcBuffer, *dstBuffer;
+    PcmKernel kernel = NULL;
+    long long nFrames, dstDataSize, done = 0;
+    size_t read = 0, written = 0;
+    int writeError = FALSE;
+    int result = 0;
+
+    if (numChannels <= 0) {
+        printf("Number of channels = 0, nothing to write.\n");
+        return 1;
+    } else if (numChannels > 2) {
+        printf("Only 1 or 2 channels supported.\n");
+        return 1;
+    }
+    if (!pcmBitsSupported(bitsPerSample)) {
+        printf("Only 8, 16, 24 or 32 bits per sample supported.\n");
+        return 1;
+    }
+
+    // Open source wave file and check its format
+    src = fopen(srcFilename, "rb");
+    if (src == NULL) {
+        return 1;
+    }
+    if (readWaveHeader(src, &srcHeader) != 0) {
+        fclose(src);
+        return 1;
+    }
+    if (srcHeader.audioFormat != 1 || !pcmBitsSupported(srcHeader.bitsPerSample) ||
+        srcHeader.numChannels > 2 ||
+        srcHeader.blockAlign != srcHeader.numChannels * srcHeader.bitsPerSample / 8) {
+        printf("Source must be 1 or 2 channel PCM with 8, 16, 24 or 32 bits per sample.\n");
+        fclose(src);
+        return 1;
+    }
+
+    // Destination header: same sample rate, same number of frames
+    nFrames = srcHeader.data_size / srcHeader.blockAlign;
+    dstHeader = makeWaveHeader(srcHeader.sampleRate, numChannels, bitsPerSample);
+    dstDataSize = nFrames * dstHeader.blockAlign;
+    if ((unsigned long long) dstDataSize > WAVE_MAX_DATA_SIZE) {
+        printf("Error: output data size %lld bytes exceeds the 4 GB wave file limit.\n", dstDataSize);
+        fclose(src);
+        return 1;
+    }
+    dstHeader.data_size = (unsigned int) dstDataSize;
+    dstHeader.overall_size = 4+8+16+8+dstHeader.data_size;
+
+    // Identical formats are a straight copy, otherwise pick the fused kernel
+    if (srcHeader.numChannels != numChannels || srcHeader.bitsPerSample != bitsPerSample) {
+        kernel = pcmKernels[srcHeader.bitsPerSample/8 - 1][bitsPerSample/8 - 1];
+    }
+
+    // Opening the destination "wb" would truncate the source if they are the same file
+    if (stat(dstFilename, &dstStat) == 0 && fstat(fileno(src), &srcStat) == 0 &&
+        srcStat.st_dev == dstStat.st_dev && srcStat.st_ino == dstStat.st_ino) {
+        printf("Error: source and destination are the same file.\n");
+        fclose(src);
+        return 1;
+    }
+
+    srcBuffer = (unsigned char*) malloc(TRANSCODE_BLOCK_FRAMES * srcHeader.blockAlign);
+    dstBuffer = (unsigned char*) malloc(TRANSCODE_BLOCK_FRAMES * dstHeader.blockAlign);
+    if (srcBuffer == NULL || dstBuffer == NULL) {
+        printf("Error: out of memory.\n");
+        free(srcBuffer);
+        free(dstBuffer);
+        fclose(src);
+        return 1;
+    }
+
+    dst = fopen(dstFilename, "wb");
+    if (dst == NULL) {
+        free(srcBuffer);
+        free(dstBuffer);
+        fclose(src);
+        return 1;
+    }
+    writeError = waveHeaderToFile(&dstHeader, dst) != 0;
+
+    // Stream data chunk block by block
+    while (!writeError && done < nFrames) {
+        long long n = nFrames - done;
+        if (n > TRANSCODE_BLOCK_FRAMES)
+            n = TRANSCODE_BLOCK_FRAMES;
+
+        read = fread(srcBuffer, srcHeader.blockAlign, n, src);
+        if (kernel != NULL) {
+            kernel(dstBuffer, srcBuffer, read, srcHeader.numChannels, numChannels);
+            written = fwrite(dstBuffer, dstHeader.blockAlign, read, dst);
+        } else {
+            written = fwrite(srcBuffer, dstHeader.blockAlign, read, dst);
+        }
+        if (written != read) {
+            writeError = TRUE;
+            break;
+        }
+        done += read;
+
+        if (read < (size_t)n) {
+            break;
+        }
+    }
+
+    // Truncated source: fix up the sizes already written to the header
+    if (!writeError && done < nFrames) {
+        printf("Error reading file. %lld of %lld frames\n", done, nFrames);
+        dstHeader.data_size = done * dstHeader.blockAlign;
+        dstHeader.overall_size = 4+8+16+8+dstHeader.data_size;
+        if (fseek(dst, 0, SEEK_SET) != 0 || waveHeaderToFile(&dstHeader, dst) != 0) {
+            writeError = TRUE;
+        }
+        result = 1;
+    }
+
+    // Memory  cleanup, a failed close means buffered data was not written
+    free(srcBuffer);
+    free(dstBuffer);
+    fclose(src);
+    if (fclose(dst) != 0) {
+        writeError = TRUE;
+    }
+    if (writeError) {
+        printf("Error writing file %s.\n", dstFilename);
+        result = 1;
+    }
+
+    return result;
+
 }
 //*****************************************************************************
 // Dump wave data
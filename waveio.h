@@ -51,3 +51,5 @@ int wavwrite(char* filename, float *dataR, float *dataL,
               );
 void displayData(float *dataL, float *dataR, int size);
 int wavread(char* filename, float **dataL, float **dataR, int size, int sampleRate, int numChannels, int bitsPerSample);
+// srcFilename and dstFilename must name different files
+int wavtranscode(char* srcFilename, char* dstFilename, int numChannels, int bitsPerSample);